@@ -23,10 +23,13 @@
 #include "arm_isa_init.cpp"
 #include "arm_bhv_macros.H"
 #include <stdint.h> // define types uint32_t, etc
+#include <stdlib.h> // getenv
 
 using namespace arm_parms;
 
 #define DEFAULT_STACK_SIZE (512 * 1024)
+// The only state shared by all cores: gives each one its core_index, and
+// so its own stack.
 static int processors_started = 0;
 
 //If you want debug information for this model, uncomment next line
@@ -41,16 +44,26 @@ static int processors_started = 0;
 //some gcc generated ARM user level code.
 #define FORGIVE_UNPREDICTABLE
 
+//If you want to be able to write binary execution traces (see
+//arm_trace.H and armtrace.cpp), uncomment next line. A trace is
+//written only when ARM_TRACE_FILE is set in the environment.
+//#define BINARY_TRACE
+
 // If FORGIVE_UNPREDITABLE is turned on, necessarily turns off
 // SYSTEM_MODEL, since the system model cannot work with this flag.
 #ifdef FORGIVE_UNPREDITABLE
 #undef SYSTEM_MODEL
 #endif
 
+// dprintf is a macro so that, with DEBUG_MODEL off, its arguments are not
+// even evaluated. In a DEBUG_MODEL build ARM_TRACE=0 in the environment
+// silences the output without rebuilding.
 #ifdef DEBUG_MODEL
 #include <stdarg.h>
 
-static inline int dprintf(const char *format, ...) {
+static bool trace_enabled = true;
+
+static inline int trace_printf(const char *format, ...) {
   int ret;
   va_list args;
   va_start(args, format);
@@ -58,8 +71,10 @@ static inline int dprintf(const char *format, ...) {
   va_end(args);
   return ret;
 }
+
+#define dprintf(...) do { if (trace_enabled) trace_printf(__VA_ARGS__); } while (0)
 #else
-inline void dprintf(const char *format, ...) {}
+#define dprintf(...) do { } while (0)
 #endif
 
 //! User defined macros to reference registers
@@ -67,25 +82,121 @@ inline void dprintf(const char *format, ...) {}
 #define PC 15 // program counter
 
 #ifdef SYSTEM_MODEL
-#define RB_write bypass_write
-#define RB_read bypass_read
+#define RB_BANK_write bypass_write
+#define RB_BANK_read bypass_read
 #else
-#define RB_write RB.write
-#define RB_read RB.read
+#define RB_BANK_write RB.write
+#define RB_BANK_read RB.read
 #endif
 
+// Global exclusive monitor, shared by all cores. A slot holds the
+// reservation of one granule: the address LDREX tagged and the core
+// that holds it (core_index + 1, 0 for a free slot). A later LDREX that
+// maps to the same slot takes it over, and a store to the granule from
+// any core drops it. STREX succeeds only while its core still holds the
+// reservation of its address. Stores only look at the table while some
+// reservation is held, so code that does not use LDREX pays one test.
+static const unsigned EXCL_SLOTS   = 64; // power of two
+static const uint32_t EXCL_GRANULE = 0xFFFFFFF8; // 8-byte granules
+
+typedef struct excl_slot_s {
+  uint32_t address;
+  unsigned owner;
+} excl_slot_t;
+
+static excl_slot_t excl_slots[EXCL_SLOTS];
+static unsigned excl_reserved = 0; // slots in use
+
+static inline excl_slot_t& excl_lookup(uint32_t address) {
+  return excl_slots[(address >> 3) & (EXCL_SLOTS - 1)];
+}
+
+static void excl_reserve(uint32_t address, unsigned core) {
+  excl_slot_t& slot = excl_lookup(address);
+  if (!slot.owner)
+    excl_reserved++;
+  slot.address = address & EXCL_GRANULE;
+  slot.owner = core + 1;
+}
+
+// Drops the reservation of address if core holds it, any core if core is
+// EXCL_ANY_CORE. Returns whether a reservation was dropped.
+static const unsigned EXCL_ANY_CORE = ~0U;
+
+static bool excl_release(uint32_t address, unsigned core) {
+  excl_slot_t& slot = excl_lookup(address);
+  if (!slot.owner || slot.address != (address & EXCL_GRANULE) ||
+      (core != EXCL_ANY_CORE && slot.owner != core + 1))
+    return false;
+  slot.owner = 0;
+  excl_reserved--;
+  return true;
+}
+
+#define excl_store(a) do { if (excl_reserved) excl_release((a), EXCL_ANY_CORE); } while (0)
+
+#ifdef BINARY_TRACE
+#include "arm_trace.H"
+
+class arm_isa::trace_writer : public arm_trace_writer {};
+
+static inline uint32_t trace_load(arm_trace_writer *t, unsigned size, uint32_t addr, uint32_t value) {
+  if (t) t->load(size, addr, value);
+  return value;
+}
+
+static inline void trace_store(arm_trace_writer *t, unsigned size, uint32_t addr, uint32_t value) {
+  if (t) t->store(size, addr, (size == 4) ? value : value & ((1U << (8 * size)) - 1));
+}
+
+#define trace_reg(r, v) do { if (trace_out) trace_out->reg_write((r), (v)); } while (0)
+// Format behaviors annul through annul_instruction(), so that the record
+// already started by the prologue is marked as not executed
+#define annul_instruction() do { if (trace_out) trace_out->annul(); ac_annul(); } while (0)
+#define MEM_read(a)          trace_load(trace_out, 4, (a), DATA_PORT->read(a))
+#define MEM_read_half(a)     (uint16_t)trace_load(trace_out, 2, (a), DATA_PORT->read_half(a))
+#define MEM_read_byte(a)     (uint8_t)trace_load(trace_out, 1, (a), DATA_PORT->read_byte(a))
+#define MEM_write(a, d)      do { excl_store(a); trace_store(trace_out, 4, (a), (d)); DATA_PORT->write((a), (d)); } while (0)
+#define MEM_write_half(a, d) do { excl_store(a); trace_store(trace_out, 2, (a), (d)); DATA_PORT->write_half((a), (d)); } while (0)
+#define MEM_write_byte(a, d) do { excl_store(a); trace_store(trace_out, 1, (a), (d)); DATA_PORT->write_byte((a), (d)); } while (0)
+#else
+#define trace_reg(r, v) do { } while (0)
+#define annul_instruction() ac_annul()
+#define MEM_read(a)          DATA_PORT->read(a)
+#define MEM_read_half(a)     DATA_PORT->read_half(a)
+#define MEM_read_byte(a)     DATA_PORT->read_byte(a)
+#define MEM_write(a, d)      do { excl_store(a); DATA_PORT->write((a), (d)); } while (0)
+#define MEM_write_half(a, d) do { excl_store(a); DATA_PORT->write_half((a), (d)); } while (0)
+#define MEM_write_byte(a, d) do { excl_store(a); DATA_PORT->write_byte((a), (d)); } while (0)
+#endif
+
+// ac_pc is the only copy of the PC, r15 is never kept in the register bank.
+// Reading r15 gives ac_pc, the address of the next instruction; operand
+// fetches that need the architectural PC+8 add the remaining 4 themselves.
+#define RB_read(r) (((r) == PC) ? (uint32_t)ac_pc : (uint32_t)RB_BANK_read(r))
+#define RB_write(r, v) do { uint32_t rb_value = (v); trace_reg((r), rb_value); \
+    if ((r) == PC) ac_pc = rb_value; else RB_BANK_write((r), rb_value); } while (0)
+
 #ifdef SLEEP_AWAKE_MODE
 /*********************************************************************************/
 /* SLEEP / AWAKE mode control                                                    */
 /* INTR_REG may store 1 (AWAKE MODE) or 0 (SLEEP MODE)                           */
 /* if intr_reg == 0, the simulator will be suspended until it receives a         */   
 /* interruption 1                                                                */    
+/* A sleeping core stays in ac_wait() until it is woken up: it executes nothing  */
+/* in between.                                                                   */
 /*********************************************************************************/
-#define test_sleep() { if (intr_reg.read() == 0) ac_wait();  }
+#define test_sleep() { while (intr_reg.read() == 0) ac_wait(); }
 #else
 #define test_sleep() {}
 #endif
 
+// Condition 1111 is the unconditional instruction space. The prologue lets
+// it through, since only the format behaviors see enough of the encoding to
+// tell CLREX, the one such instruction the model implements, from the rest
+// (such as pld, which decodes as an ldrb). Every other format skips it.
+#define skip_unconditional() { if (cond == 15) { annul_instruction(); return; } }
+
 void ac_behavior( begin ) {
 #ifdef SYSTEM_MODEL
   arm_proc_mode.mode = processor_mode::SUPERVISOR_MODE;
@@ -95,12 +206,10 @@ void ac_behavior( begin ) {
   ac_pc = 0;
 #endif
   // Initializing flags and model variables
-  flags.Z = false;
-  flags.C = false;
-  flags.N = false; 
-  flags.V = false;
+  flags.NZCV = 0;
   flags.Q = false;
   flags.T = false;
+  flags_src = FLAGS_RESOLVED;
   execute = false;
   dpi_shiftop.entire = 0;
   dpi_shiftopcarry = false;
@@ -110,7 +219,35 @@ void ac_behavior( begin ) {
   OP1.entire = 0;
   OP2.entire = 0;
 
-  RB.write(13, AC_RAM_END - 1024 - processors_started++ * DEFAULT_STACK_SIZE);
+#ifdef DEBUG_MODEL
+  const char *trace_env = getenv("ARM_TRACE");
+  trace_enabled = !(trace_env && atoi(trace_env) == 0);
+#endif
+
+  core_index = processors_started++;
+  excl_held = false;
+  trace_out = NULL;
+
+#ifdef BINARY_TRACE
+  // ARM_TRACE_FILE=<path> writes a binary execution trace. Cores other than
+  // the first one append their index to the file name.
+  const char *trace_file = getenv("ARM_TRACE_FILE");
+  if (trace_file) {
+    char trace_path[1024];
+    if (core_index == 0)
+      snprintf(trace_path, sizeof(trace_path), "%s", trace_file);
+    else
+      snprintf(trace_path, sizeof(trace_path), "%s.%u", trace_file, core_index);
+    trace_out = new trace_writer;
+    if (!trace_out->open(trace_path)) {
+      fprintf(stderr, "Cannot open trace file %s\n", trace_path);
+      delete trace_out;
+      trace_out = NULL;
+    }
+  }
+#endif
+
+  RB.write(13, AC_RAM_END - 1024 - core_index * DEFAULT_STACK_SIZE);
 }
 
 //!Generic instruction behavior method.
@@ -121,30 +258,23 @@ void ac_behavior( instruction ) {
   dprintf("-------------------- PC=%#x -------------------- %lld\n", (uint32_t)ac_pc, ac_instr_counter);
 
   // Conditionally executes instruction based on COND field, common to all ARM instructions.
-  execute = false;
-
-  switch(cond) {
-    case  0: if (flags.Z == true) execute = true; break;
-    case  1: if (flags.Z == false) execute = true; break;
-    case  2: if (flags.C == true) execute = true; break;
-    case  3: if (flags.C == false) execute = true; break;
-    case  4: if (flags.N == true) execute = true; break;
-    case  5: if (flags.N == false) execute = true; break; 
-    case  6: if (flags.V == true) execute = true; break;
-    case  7: if (flags.V == false) execute = true; break; 
-    case  8: if ((flags.C == true)&&(flags.Z == false)) execute = true; break; 
-    case  9: if ((flags.C == false)||(flags.Z == true)) execute = true; break;
-    case 10: if (flags.N == flags.V) execute = true; break;
-    case 11: if (flags.N != flags.V) execute = true; break; 
-    case 12: if ((flags.Z == false)&&(flags.N == flags.V)) execute = true; break;
-    case 13: if ((flags.Z == true)||(flags.N != flags.V)) execute = true;  break;
-    case 14: execute = true; break;
-    default: execute = false;
+  // Condition-always instructions do not look at the flags at all, and
+  // condition 1111 is left to the format behaviors (see skip_unconditional).
+  if (cond >= 14)
+    execute = true;
+  else {
+    flags_resolve();
+    execute = ConditionPassed(cond, flags.NZCV);
   }
 
+#ifdef BINARY_TRACE
+  // The word is fetched from the instruction side, so that tracing does not
+  // add data-side accesses
+  if (trace_out) trace_out->instruction((uint32_t)ac_pc, INST_PORT->read(ac_pc), execute);
+#endif
+
   // PC increment
   ac_pc += 4;
-  RB_write(PC, ac_pc);
 
   if(!execute) {
     dprintf("cond=0x%X\n", cond);
@@ -157,6 +287,7 @@ void ac_behavior( instruction ) {
 
 //!DPI1 - Second operand is register with imm shift
 void ac_behavior( Type_DPI1 ) {
+  skip_unconditional();
 
   arm_isa::reg_t RM2;
 
@@ -167,61 +298,12 @@ void ac_behavior( Type_DPI1 ) {
   }
   else RM2.entire = RB_read(rm);
       
-  switch(shift) {
-  case 0: // Logical shift left
-    if ((shiftamount >= 0) && (shiftamount <= 31)) {
-      if (shiftamount == 0) {
-	dpi_shiftop.entire = RM2.entire;
-	dpi_shiftopcarry = flags.C;
-      } else {
-	dpi_shiftop.entire = RM2.entire << shiftamount;
-	dpi_shiftopcarry = getBit(RM2.entire, 32 - shiftamount);
-      }
-    }
-    break;
-  case 1: // Logical shift right
-    if ((shiftamount >= 0) && (shiftamount <= 31)) {
-      if (shiftamount == 0) {
-	dpi_shiftop.entire = 0;
-	dpi_shiftopcarry = getBit(RM2.entire, 31);
-      } else {
-	dpi_shiftop.entire = ((uint32_t) RM2.entire) >> shiftamount;
-	dpi_shiftopcarry = getBit(RM2.entire, shiftamount - 1);
-      }
-    }
-    break;
-  case 2: // Arithmetic shift right
-    if ((shiftamount >= 0) && (shiftamount <= 31)) {
-      if (shiftamount == 0) {
-	if (!isBitSet(RM2.entire, 31)) {
-	  dpi_shiftop.entire = 0;
-	  dpi_shiftopcarry = getBit(RM2.entire, 31);
-	} else {
-	  dpi_shiftop.entire = 0xFFFFFFFF;
-	  dpi_shiftopcarry = getBit(RM2.entire, 31);
-	}
-      } else {
-	dpi_shiftop.entire = ((int32_t) RM2.entire) >> shiftamount;
-	dpi_shiftopcarry = getBit(RM2.entire, shiftamount - 1);
-      }
-    }
-    break;
-  default: // Rotate right
-    if ((shiftamount >= 0) && (shiftamount <= 31)) {
-      if (shiftamount == 0) { //Rotate right with extend
-	dpi_shiftopcarry = getBit(RM2.entire, 0);
-	dpi_shiftop.entire = (((uint32_t)RM2.entire) >> 1);
-	if (flags.C) setBit(dpi_shiftop.entire, 31);
-      } else {
-	dpi_shiftop.entire = (RotateRight(shiftamount, RM2)).entire;
-	dpi_shiftopcarry = getBit(RM2.entire, shiftamount - 1);
-      }
-    }
-  }
+  dpi_shiftop.entire = ShiftByImmediate(shift, RM2.entire, shiftamount, dpi_shiftopcarry);
 }
 
 //!DPI2 - Second operand is shifted (shift amount given by third register operand)
 void ac_behavior( Type_DPI2 ) {
+  skip_unconditional();
 
   int rs40;
   arm_isa::reg_t RS2, RM2;
@@ -229,7 +311,7 @@ void ac_behavior( Type_DPI2 ) {
   // Special case: r* = 15
   if ((rd == 15)||(rm == 15)||(rn == 15)||(rs == 15)) {
     printf("Register 15 cannot be used in this instruction.\n");
-    ac_annul(); 
+    annul_instruction(); 
   }
 
   RM2.entire = RB_read(rm);
@@ -240,7 +322,7 @@ void ac_behavior( Type_DPI2 ) {
   case 0: // Logical shift left
     if (RS2.byte[0] == 0) {
       dpi_shiftop.entire = RM2.entire;
-      dpi_shiftopcarry = flags.C;
+      dpi_shiftopcarry = flagC();
     }
     else if (((uint8_t)RS2.byte[0]) < 32) {
       dpi_shiftop.entire = RM2.entire << (uint8_t)RS2.byte[0];
@@ -258,7 +340,7 @@ void ac_behavior( Type_DPI2 ) {
   case 1: // Logical shift right
     if (RS2.byte[0] == 0) {
       dpi_shiftop.entire = RM2.entire;
-      dpi_shiftopcarry = flags.C;
+      dpi_shiftopcarry = flagC();
     }
     else if (((uint8_t)RS2.byte[0]) < 32) {
       dpi_shiftop.entire = ((uint32_t) RM2.entire) >> ((uint8_t)RS2.byte[0]);
@@ -276,7 +358,7 @@ void ac_behavior( Type_DPI2 ) {
   case 2: // Arithmetical shift right
     if (RS2.byte[0] == 0) {
       dpi_shiftop.entire = RM2.entire;
-      dpi_shiftopcarry = flags.C;
+      dpi_shiftopcarry = flagC();
     }
     else if (((uint8_t)RS2.byte[0]) < 32) {
       dpi_shiftop.entire = ((int32_t) RM2.entire) >> ((uint8_t)RS2.byte[0]);
@@ -295,7 +377,7 @@ void ac_behavior( Type_DPI2 ) {
   default: // Rotate right
     if (RS2.byte[0] == 0) {
       dpi_shiftop.entire = RM2.entire;
-      dpi_shiftopcarry = flags.C;
+      dpi_shiftopcarry = flagC();
     }
     else if (rs40 == 0) {
       dpi_shiftop.entire = RM2.entire;
@@ -310,38 +392,41 @@ void ac_behavior( Type_DPI2 ) {
 
 //!DPI3 - Second operand is immediate shifted by another imm
 void ac_behavior( Type_DPI3 ){
-  int32_t tmp;
-  tmp = (uint32_t)imm8;
-  dpi_shiftop.entire = (((uint32_t)tmp) >> (2 * rotate)) | (((uint32_t)tmp) << (32 - (2 * rotate)));
+  skip_unconditional();
+
+  arm_isa::reg_t tmp;
+  tmp.entire = (uint32_t)imm8;
+  dpi_shiftop.entire = (RotateRight(2 * rotate, tmp)).entire;
 
   if (rotate == 0) 
-    dpi_shiftopcarry = flags.C;
+    dpi_shiftopcarry = flagC();
   else 
     dpi_shiftopcarry = getBit(dpi_shiftop.entire, 31);    
 }
 
 void ac_behavior( Type_BBL ) {
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_BBLT ) {
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_MBXBLX ) {
-  // no special actions necessary
+  skip_unconditional();
 }
 
 //!MULT1 - 32-bit result multiplication
 void ac_behavior( Type_MULT1 ) {
-  // no special actions necessary
+  skip_unconditional();
 }
 
 //!MULT2 - 64-bit result multiplication
 void ac_behavior( Type_MULT2 ) {
-  // no special actions necessary
+  skip_unconditional();
 }
 
 //!LSI - Load Store Immediate Offset/Index
 void ac_behavior( Type_LSI ) {
+  skip_unconditional();
 
   arm_isa::reg_t RN2;
   RN2.entire = RB_read(rn);
@@ -364,13 +449,13 @@ void ac_behavior( Type_LSI ) {
     // Special case: Rn = PC
     if (rn == PC) {
       printf("Unpredictable LSI instruction result (Can't writeback to PC, Rn = PC)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case: Rn = Rd
     if (rn == rd) {
       printf("Unpredictable LSI instruction result  (Can't writeback to loaded register, Rn = Rd)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     
@@ -386,13 +471,13 @@ void ac_behavior( Type_LSI ) {
     // Special case: Rn = PC
     if (rn == PC) {
       printf("Unpredictable LSI instruction result (Can't writeback to PC, Rn = PC)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rn = Rd
     if (rn == rd) {
       printf("Unpredictable LSI instruction result (Can't writeback to loaded register, Rn = Rd)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     
@@ -410,8 +495,10 @@ void ac_behavior( Type_LSI ) {
 
 //!LSR - Scaled Register Offset/Index
 void ac_behavior( Type_LSR ) {
+  skip_unconditional();
 
-  arm_isa::reg_t RM2, RN2, index, tmp;
+  arm_isa::reg_t RM2, RN2, index;
+  bool carry; // not used, the index does not update the flags
 
   RM2.entire = RB_read(rm);
   RN2.entire = RB_read(rn);
@@ -427,33 +514,7 @@ void ac_behavior( Type_LSR ) {
       return;
     }
 
-    switch(shift){
-    case 0:
-      if(shiftamount == 0) { // Register
-	index.entire = RM2.entire;
-      } else { // Scalled logical shift left
-	index.entire = RM2.entire << shiftamount;
-      }
-      break;
-    case 1: // logical shift right
-      if(shiftamount == 0) index.entire = 0;
-      else index.entire = ((uint32_t) RM2.entire) >> shiftamount;
-      break;
-    case 2: // arithmetic shift right
-      if(shiftamount == 0) {
-	if (isBitSet(RM2.entire, 31)) index.entire = 0xFFFFFFFF;
-	else index.entire = 0;
-      } else index.entire = ((int32_t) RM2.entire) >> shiftamount;
-      break;
-    default:
-      if(shiftamount == 0) { // RRX
-	tmp.entire = 0;
-	if(flags.C) setBit(tmp.entire, 31);
-	index.entire = tmp.entire | (((uint32_t) RM2.entire) >> 1);
-      } else { // rotate right
-	index.entire = (RotateRight(shiftamount, RM2)).entire;
-      }
-    }
+    index.entire = ShiftByImmediate(shift, RM2.entire, shiftamount, carry);
 
     if(u == 1) {
       ls_address.entire += (RN2.entire + index.entire);
@@ -466,57 +527,29 @@ void ac_behavior( Type_LSR ) {
     // Special case: Rn = PC
     if (rn == PC) {
       printf("Unpredictable LSR instruction result (Can't writeback to PC, Rn = PC)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rn = Rd
     if (rn == rd) {
       printf("Unpredictable LSR instruction result (Can't writeback to loaded register, Rn = Rd)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rm = PC
     if (rm == PC) {
       printf("Unpredictable LSR instruction result (Illegal usage of PC, Rm = PC)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rn = Rm
     if (rn == rm) {
       printf("Unpredictable LSR instruction result (Can't use the same register for Rn and Rm\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     
-    switch(shift){
-    case 0:
-      if(shiftamount == 0) { // Register
-	index.entire = RM2.entire;
-      } else { // Scaled logical shift left
-	index.entire = RM2.entire << shiftamount;
-      } 
-      break;
-    case 1: // logical shift right
-      if(shiftamount == 0) index.entire = 0;
-      else index.entire = ((uint32_t) RM2.entire) >> shiftamount;
-      break;
-    case 2: // arithmetic shift right
-      if(shiftamount == 0) {
-	if (isBitSet(RM2.entire,31)) 
-	  index.entire = 0xFFFFFFFF;
-	else 
-	  index.entire = 0;
-      } else index.entire = ((int32_t) RM2.entire) >> shiftamount;
-      break;
-    default:
-      if(shiftamount == 0) { // RRX
-	tmp.entire = 0;
-	if (flags.C) setBit(tmp.entire,31);
-	index.entire = tmp.entire | (((uint32_t) RM2.entire) >> 1);
-      } else { // rotate right
-	index.entire = (RotateRight(shiftamount, RM2)).entire;
-      }
-    }
+    index.entire = ShiftByImmediate(shift, RM2.entire, shiftamount, carry);
 
     if(u == 1) {
       ls_address.entire = RN2.entire + index.entire;
@@ -531,59 +564,31 @@ void ac_behavior( Type_LSR ) {
     // Special case: Rn = PC
     if (rn == PC) {
       printf("Unpredictable LSR instruction result (Can't writeback to PC, Rn = PC)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rn = Rd
     if (rn == rd) {
       printf("Unpredictable LSR instruction result (Can't writeback to loaded register, Rn = Rd)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rm = PC
     if (rm == PC) {
       printf("Unpredictable LSR instruction result (Illegal usage of PC, Rm = PC)\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     // Special case Rn = Rm
     if (rn == rm) {
       printf("Unpredictable LSR instruction result (Can't use the same register for Rn and Rm\n");
-      ac_annul();
+      annul_instruction();
       return;
     }
     
     ls_address.entire = RN2.entire;
 
-    switch(shift) {
-    case 0:
-      if(shiftamount == 0) { // Register
-	index.entire = RM2.entire;
-      } else { // Scaled logical shift left
-	index.entire = RM2.entire << shiftamount;
-      }
-      break;
-    case 1: // logical shift right
-      if(shiftamount == 0) index.entire = 0;
-      else index.entire = ((uint32_t) RM2.entire) >> shiftamount;
-      break;
-    case 2: // arithmetic shift right
-      if(shiftamount == 0) {
-	if (isBitSet(RM2.entire, 31)) 
-	  index.entire = 0xFFFFFFFF;
-	else 
-	  index.entire = 0;
-      } else index.entire = ((int32_t) RM2.entire) >> shiftamount;
-      break;
-    default:
-      if(shiftamount == 0) { // RRX
-	tmp.entire = 0;
-	if(flags.C) setBit(tmp.entire, 31);
-	index.entire = tmp.entire | (((uint32_t) RM2.entire) >> 1);	
-      } else { // rotate right
-	index.entire = (RotateRight(shiftamount, RM2)).entire;
-      }
-    }
+    index.entire = ShiftByImmediate(shift, RM2.entire, shiftamount, carry);
 
     if(u == 1) {
       RB_write(rn, RN2.entire + index.entire);
@@ -595,6 +600,7 @@ void ac_behavior( Type_LSR ) {
 
 //!LSE - Load Store HalfWord
 void ac_behavior( Type_LSE ){
+  skip_unconditional();
 
   int32_t off8;
   arm_isa::reg_t RM2, RN2;
@@ -602,12 +608,12 @@ void ac_behavior( Type_LSE ){
   // Special cases handling
   if((p == 0)&&(w == 1)) {
     printf("Unpredictable LSE instruction result");
-    ac_annul();
+    annul_instruction();
     return;
   }
   if((ss == 0)&&(hh == 0)) {
     printf("Decoding error: this is not a LSE instruction");
-    ac_annul();
+    annul_instruction();
     return;
   }
   if((ss == 1)&&(l == 0)) 
@@ -636,7 +642,7 @@ void ac_behavior( Type_LSE ){
       // Special case Rm = PC
       if (addr2 == PC) {
 	printf("Unpredictable LSE instruction result (Illegal usage of PC, Rm = PC)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
 
@@ -654,13 +660,13 @@ void ac_behavior( Type_LSE ){
       // Special case: Rn = PC
       if (rn == PC) {
 	printf("Unpredictable LSE instruction result (Can't writeback to PC, Rn = PC)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rn = Rd
       if (rn == rd) {
 	printf("Unpredictable LSE instruction result (Can't writeback to loaded register, Rn = Rd)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       
@@ -677,25 +683,25 @@ void ac_behavior( Type_LSE ){
       // Special case: Rn = PC
       if (rn == PC) {
 	printf("Unpredictable LSE instruction result (Can't writeback to PC, Rn = PC)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rn = Rd
       if (rn == rd) {
 	printf("Unpredictable LSE instruction result (Can't writeback to loaded register, Rn = Rd)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rm = PC
       if (addr2 == PC) {
 	printf("Unpredictable LSE instruction result (Illegal usage of PC, Rm = PC)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rn = Rm
       if (rn == addr2) {
 	printf("Unpredictable LSE instruction result (Can't use the same register for Rn and Rm\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       
@@ -712,7 +718,7 @@ void ac_behavior( Type_LSE ){
     if((i == 1)&&(w == 0)) { // immediate post-indexed
       if(rn == PC) {
 	printf("Unpredictable LSE instruction result");
-	ac_annul();
+	annul_instruction();
 	return;
       }
 
@@ -727,25 +733,25 @@ void ac_behavior( Type_LSE ){
       // Special case: Rn = PC
       if (rn == PC) {
 	printf("Unpredictable LSE instruction result (Can't writeback to PC, Rn = PC)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rn = Rd
       if (rn == rd) {
 	printf("Unpredictable LSE instruction result (Can't writeback to loaded register, Rn = Rd)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rm = PC
       if (addr2 == PC) {
 	printf("Unpredictable LSE instruction result (Illegal usage of PC, Rm = PC)\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       // Special case Rn = Rm
       if (rn == addr2) {
 	printf("Unpredictable LSE instruction result (Can't use the same register for Rn and Rm\n");
-	ac_annul();
+	annul_instruction();
 	return;
       }
       
@@ -761,6 +767,7 @@ void ac_behavior( Type_LSE ){
 
 //!LSM - Load Store Multiple
 void ac_behavior( Type_LSM ){
+  skip_unconditional();
 
   arm_isa::reg_t RN2;
   int setbits;
@@ -772,16 +779,17 @@ void ac_behavior( Type_LSM ){
   // Special case - empty list
   if (registerList.entire == 0) {
     printf("Unpredictable LSM instruction result (No register specified)\n");
-    ac_annul();
+    annul_instruction();
     return;
   }
   
   RN2.entire = RB_read(rn);
   setbits = LSM_CountSetBits(registerList);
 
-  // Special case Rn in Rlist
-  if((w == 1)&&(isBitSet(rlist,rn))) {
-    lsm_oldrn.entire = RB_read(rn);
+  // Special case Rn in Rlist: STM stores the value Rn had before the
+  // writeback
+  if(isBitSet(rlist,rn)) {
+    lsm_oldrn.entire = RN2.entire;
   }
 
   if((p == 0)&&(u == 1)) { // increment after
@@ -809,31 +817,36 @@ void ac_behavior( Type_LSM ){
 }
 
 void ac_behavior( Type_CDP ){
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_CRT ){
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_CLS ){
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_MBKPT ){
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_MSWI ){
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_MCLZ ){
-  // no special actions necessary
+  // clrex is the only instruction of this format with op = 2
+  if ((cond == 15) && (op != 2)) {
+    annul_instruction();
+    return;
+  }
 }
 void ac_behavior( Type_MMSR1 ){
-  // no special actions necessary
+  skip_unconditional();
 }
 void ac_behavior( Type_MMSR2 ){
-  // no special actions necessary
+  skip_unconditional();
 }
 
 void ac_behavior( Type_DSPSM ){
+  skip_unconditional();
 
   arm_isa::reg_t RM2, RS2;
   
@@ -864,15 +877,13 @@ void ac_behavior( Type_DSPSM ){
 void arm_isa::ADC(int rd, int rn, bool s) {
 
   arm_isa::reg_t RD2, RN2;
-  arm_isa::r64bit_t soma;
+  bool carry = flagC();
 
   dprintf("Instruction: ADC\n");
   RN2.entire = RB_read(rn);
   if(rn == PC) RN2.entire += 4;
-  dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n  Carry=%d\n", RN2.entire,dpi_shiftop.entire,flags.C);
-  soma.hilo = (uint64_t)(uint32_t)RN2.entire + (uint64_t)(uint32_t)dpi_shiftop.entire;
-  if (flags.C) soma.hilo++;
-  RD2.entire = soma.reg[0];
+  dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n  Carry=%d\n", RN2.entire,dpi_shiftop.entire,carry);
+  RD2.entire = (uint32_t)RN2.entire + (uint32_t)dpi_shiftop.entire + (carry ? 1 : 0);
   RB_write(rd, RD2.entire);
   if ((s == 1)&&(rd == PC)) {
 #ifndef FORGIVE_UNPREDICTABLE
@@ -881,30 +892,23 @@ void arm_isa::ADC(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = ((soma.reg[1] != 0) ? true : false);
-      flags.V = (((getBit(RN2.entire,31) && getBit(dpi_shiftop.entire,31) && (!getBit(RD2.entire,31))) ||
-		  ((!getBit(RN2.entire,31)) && (!getBit(dpi_shiftop.entire,31)) && getBit(RD2.entire,31))) ? true : false);
+      flags_set_add(RN2.entire, dpi_shiftop.entire, carry, RD2.entire);
     }
   }
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
 void arm_isa::ADD(int rd, int rn, bool s) {
 
   arm_isa::reg_t RD2, RN2;
-  arm_isa::r64bit_t soma;
 
   dprintf("Instruction: ADD\n");
   RN2.entire = RB_read(rn);
   if(rn == PC) RN2.entire += 4;
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
-  soma.hilo = (uint64_t)(uint32_t)RN2.entire + (uint64_t)(uint32_t)dpi_shiftop.entire;
-  RD2.entire = soma.reg[0];
+  RD2.entire = (uint32_t)RN2.entire + (uint32_t)dpi_shiftop.entire;
   RB_write(rd, RD2.entire);
   if ((s == 1)&&(rd == PC)) {
 #ifndef FORGIVE_UNPREDICTABLE
@@ -917,16 +921,11 @@ void arm_isa::ADD(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = ((soma.reg[1] != 0) ? true : false);
-      flags.V = (((getBit(RN2.entire,31) && getBit(dpi_shiftop.entire,31) && (!getBit(RD2.entire,31))) ||
-		  ((!getBit(RN2.entire,31)) && (!getBit(dpi_shiftop.entire,31)) && getBit(RD2.entire,31))) ? true : false);
+      flags_set_add(RN2.entire, dpi_shiftop.entire, false, RD2.entire);
     }
   }
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -951,15 +950,11 @@ void arm_isa::AND(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire, 31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = dpi_shiftopcarry;
-      // nothing happens with flags.V 
+      flags_set_logic(RD2.entire, dpi_shiftopcarry);
     }
   }   
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -984,8 +979,6 @@ void arm_isa::B(int h, int offset) {
     RB_write(PC, mem_pos);
 
     //fprintf(stderr, "0x%X\n", (unsigned int)mem_pos);
-
-    ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1026,15 +1019,11 @@ void arm_isa::BIC(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = dpi_shiftopcarry;
-      // nothing happens with flags.V 
+      flags_set_logic(RD2.entire, dpi_shiftopcarry);
     }
   }   
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1047,7 +1036,6 @@ void arm_isa::CDP(){
 void arm_isa::CLZ(int rd, int rm) {
 
   arm_isa::reg_t RD2, RM2;
-  int i;
 
   dprintf("Instruction: CLZ\n");
 
@@ -1065,62 +1053,43 @@ void arm_isa::CLZ(int rd, int rm) {
 
   RM2.entire = RB_read(rm);
 
+  // __builtin_clz is undefined for 0
   if(RM2.entire == 0) RD2.entire = 32;
-  else {
-    i = 31;
-    while((i>=0)&&(!isBitSet(RM2.entire,i))) i--;
-    RD2.entire = 31 - i;
-  }
+  else RD2.entire = __builtin_clz((uint32_t)RM2.entire);
 
   RB_write(rd, RD2.entire);
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
     
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
 void arm_isa::CMN(int rn) {
 
   arm_isa::reg_t RN2, alu_out;
-  arm_isa::r64bit_t soma;
 
   dprintf("Instruction: CMN\n");
   RN2.entire = RB_read(rn);
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
-  soma.hilo = (uint64_t)(uint32_t)RN2.entire + (uint64_t)(uint32_t)dpi_shiftop.entire;
-  alu_out.entire = soma.reg[0];
+  alu_out.entire = (uint32_t)RN2.entire + (uint32_t)dpi_shiftop.entire;
 
-  flags.N = getBit(alu_out.entire,31);
-  flags.Z = ((alu_out.entire == 0) ? true : false);
-  flags.C = ((soma.reg[1] != 0) ? true : false);
-  flags.V = (((getBit(RN2.entire,31) && getBit(dpi_shiftop.entire,31) && (!getBit(alu_out.entire,31))) ||
-	      ((!getBit(RN2.entire,31)) && (!getBit(dpi_shiftop.entire,31)) && getBit(alu_out.entire,31))) ? true : false);
+  flags_set_add(RN2.entire, dpi_shiftop.entire, false, alu_out.entire);
 
-  dprintf("Results: 0x%lX\n *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", alu_out.entire,flags.N,flags.Z,flags.C,flags.V);    
-  ac_pc = RB_read(PC);
+  dprintf("Results: 0x%lX\n *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", alu_out.entire,flagN(),flagZ(),flagC(),flagV());    
 }
 
 //------------------------------------------------------
 void arm_isa::CMP(int rn) {
 
-  arm_isa::reg_t RN2, alu_out, neg_shiftop;
-  arm_isa::r64bit_t result;
+  arm_isa::reg_t RN2, alu_out;
 
   dprintf("Instruction: CMP\n");
   RN2.entire = RB_read(rn);
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
-  neg_shiftop.entire = - dpi_shiftop.entire;
-  result.hilo = (uint64_t)(uint32_t)RN2.entire + (uint64_t)(uint32_t)neg_shiftop.entire;
-  alu_out.entire = result.reg[0];
-
-  flags.N = getBit(alu_out.entire,31);
-  flags.Z = ((alu_out.entire == 0) ? true : false);
-  flags.C = !(((uint32_t) dpi_shiftop.entire > (uint32_t) RN2.entire) ? true : false);
-  flags.V = (((getBit(RN2.entire,31) && getBit(neg_shiftop.entire,31) && (!getBit(alu_out.entire,31))) ||
-	      ((!getBit(RN2.entire,31)) && (!getBit(neg_shiftop.entire,31)) && getBit(alu_out.entire,31))) ? true : false);
+  alu_out.entire = (uint32_t)RN2.entire - (uint32_t)dpi_shiftop.entire;
+
+  flags_set_add(RN2.entire, ~dpi_shiftop.entire, true, alu_out.entire);
   
-  dprintf("Results: 0x%lX\n *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", alu_out.entire,flags.N,flags.Z,flags.C,flags.V);     
-  ac_pc = RB_read(PC);
+  dprintf("Results: 0x%lX\n *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n", alu_out.entire,flagN(),flagZ(),flagC(),flagV());     
 }
 
 //------------------------------------------------------
@@ -1145,15 +1114,11 @@ void arm_isa::EOR(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire, 31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = dpi_shiftopcarry;
-      // nothing happens with flags.V 
+      flags_set_logic(RD2.entire, dpi_shiftopcarry);
     }
   }   
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V); 
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV()); 
 }
 
 //------------------------------------------------------
@@ -1169,21 +1134,24 @@ void arm_isa::LDM(int rlist, bool r) {
 
   int i;
   int32_t value;
+  // Registers of rlist still to be loaded. The loops below visit only the
+  // registers in the list, lowest first, each one taking the next word of
+  // the block starting at lsm_startaddress.
+  unsigned list;
 
   if (r == 0) { // LDM(1)
     dprintf("Instruction: LDM\n");
     ls_address = lsm_startaddress;
     dprintf("Initial address: 0x%lX\n",ls_address.entire);
-    for(i=0;i<15;i++){
-      if(isBitSet(rlist,i)) {
-        RB_write(i,DATA_PORT->read(ls_address.entire));
-        ls_address.entire += 4;
-        dprintf(" *  Loaded register: 0x%X; Value: 0x%X; Next address: 0x%lX\n", i,RB_read(i),ls_address.entire-4);
-      }
+    for (list = rlist & 0x7FFF; list != 0; list &= list - 1) {
+      i = __builtin_ctz(list);
+      RB_write(i,MEM_read(ls_address.entire));
+      ls_address.entire += 4;
+      dprintf(" *  Loaded register: 0x%X; Value: 0x%X; Next address: 0x%lX\n", i,RB_read(i),ls_address.entire-4);
     }
     
     if((isBitSet(rlist,PC))) { // LDM(1)
-      value = DATA_PORT->read(ls_address.entire);
+      value = MEM_read(ls_address.entire);
       RB_write(PC,value & 0xFFFFFFFE);
       ls_address.entire += 4;
       dprintf(" *  Loaded register: PC; Next address: 0x%lX\n", ls_address.entire);
@@ -1199,16 +1167,15 @@ void arm_isa::LDM(int rlist, bool r) {
     dprintf("Instruction: LDM\n");
     ls_address = lsm_startaddress;
     dprintf("Initial address: 0x%lX\n",ls_address.entire);
-    for(i=0;i<15;i++){
-      if(isBitSet(rlist,i)) {
-        RB.write(i,DATA_PORT->read(ls_address.entire));
-        ls_address.entire += 4;
-        dprintf(" *  Loaded register: 0x%X; Value: 0x%X; Next address: 0x%lX\n", i,RB_read(i),ls_address.entire);
-      }
+    for (list = rlist & 0x7FFF; list != 0; list &= list - 1) {
+      i = __builtin_ctz(list);
+      RB.write(i,MEM_read(ls_address.entire));
+      ls_address.entire += 4;
+      dprintf(" *  Loaded register: 0x%X; Value: 0x%X; Next address: 0x%lX\n", i,RB_read(i),ls_address.entire);
     }
     if((isBitSet(rlist,PC))) { // LDM(3)
-      value = DATA_PORT->read(ls_address.entire);
-      RB.write(PC,value & 0xFFFFFFFE);
+      value = MEM_read(ls_address.entire);
+      ac_pc = value & 0xFFFFFFFE;
       ls_address.entire += 4;
       dprintf(" *  Loaded register: PC; Next address: 0x%lX\n", ls_address.entire);
 #ifndef FORGIVE_UNPREDICTABLE
@@ -1216,8 +1183,6 @@ void arm_isa::LDM(int rlist, bool r) {
 #endif
     }
   }
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1237,18 +1202,18 @@ void arm_isa::LDR(int rd, int rn) {
       
   switch(addr10) {
   case 0:
-    value = DATA_PORT->read(ls_address.entire);
+    value = MEM_read(ls_address.entire);
     break;
   case 1:
-    tmp.entire = DATA_PORT->read(ls_address.entire);
+    tmp.entire = MEM_read(ls_address.entire);
     value = (arm_isa::RotateRight(8,tmp)).entire;
     break;
   case 2:
-    tmp.entire = DATA_PORT->read(ls_address.entire);
+    tmp.entire = MEM_read(ls_address.entire);
     value = (arm_isa::RotateRight(16,tmp)).entire;
     break;
   default:
-    tmp.entire = DATA_PORT->read(ls_address.entire);
+    tmp.entire = MEM_read(ls_address.entire);
     value = (arm_isa::RotateRight(24,tmp)).entire;
   }
     
@@ -1262,8 +1227,6 @@ void arm_isa::LDR(int rd, int rn) {
       RB_write(rd,value);
       dprintf(" *  R%d <= 0x%08X\n", rd, value);
     }
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1274,14 +1237,12 @@ void arm_isa::LDRB(int rd, int rn) {
 
   // Special cases
   dprintf("Reading memory position 0x%08X\n", ls_address.entire);
-  value = (uint8_t) DATA_PORT->read_byte(ls_address.entire);
+  value = (uint8_t) MEM_read_byte(ls_address.entire);
   
   dprintf("Byte: 0x%X\n", value);
   RB_write(rd, ((uint32_t)value));
 
   dprintf(" *  R%d <= 0x%02X\n", rd, value);
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1293,14 +1254,12 @@ void arm_isa::LDRBT(int rd, int rn) {
 
   // Special cases
   dprintf("Reading memory position 0x%08X\n", ls_address.entire);
-  value = (uint8_t) DATA_PORT->read_byte(ls_address.entire);
+  value = (uint8_t) MEM_read_byte(ls_address.entire);
   
   dprintf("Byte: 0x%X\n", (uint32_t) value);
   RB_write(rd, (uint32_t) value);
 
   dprintf(" *  R%d <= 0x%02X\n", rd, value);
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1309,8 +1268,8 @@ void arm_isa::LDRD(int rd, int rn) {
 
   dprintf("Instruction: LDRD\n");
   dprintf("Reading memory position 0x%08X\n", ls_address.entire);
-  value1 = DATA_PORT->read_byte(ls_address.entire);
-  value2 = DATA_PORT->read_byte(ls_address.entire+4);
+  value1 = MEM_read_byte(ls_address.entire);
+  value2 = MEM_read_byte(ls_address.entire+4);
 
   // Special cases
   // Registrador destino deve ser par
@@ -1329,8 +1288,6 @@ void arm_isa::LDRD(int rd, int rn) {
   RB_write(rd+1, value2);
 
   dprintf(" *  R%d <= 0x%08X\n *  R%d <= 0x%08X\n (little) value = 0x%08X%08X\n (big) value = 0x%08X08X\n", rd, value1, rd+1, value2, value2, value1, value1, value2);
-
-  ac_pc = RB_read(PC);
 }
 //------------------------------------------------------
 void arm_isa::LDRH(int rd, int rn) {
@@ -1345,13 +1302,11 @@ void arm_isa::LDRH(int rd, int rn) {
     printf("Unpredictable LDRH instruction result (Address is not Halfword Aligned)\n");
     return;
   }
-  value = DATA_PORT->read_half(ls_address.entire);
+  value = MEM_read_half(ls_address.entire);
 
   RB_write(rd, value);
 
   dprintf(" *  R%d <= 0x%04X\n", rd, value); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1363,14 +1318,13 @@ void arm_isa::LDRSB(int rd, int rn) {
     
   // Special cases
   dprintf("Reading memory position 0x%08X\n", ls_address.entire);  
-  data = DATA_PORT->read_byte(ls_address.entire);
+  data = MEM_read_byte(ls_address.entire);
   data = arm_isa::SignExtend(data, 8);
 
   RB_write(rd, data);
 
   dprintf(" *  R%d <= 0x%08X\n", rd, data); 
  
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1388,14 +1342,13 @@ void arm_isa::LDRSH(int rd, int rn){
   }
   // Verify coprocessor alignment
 
-  data = DATA_PORT->read_half(ls_address.entire);
+  data = MEM_read_half(ls_address.entire);
   
   data = arm_isa::SignExtend(data,16);
   RB_write(rd, data);
 
   dprintf(" *  R%d <= 0x%08X\n", rd, data); 
     
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1416,28 +1369,26 @@ void arm_isa::LDRT(int rd, int rn) {
     
   switch(addr10) {
   case 0:
-    value = DATA_PORT->read(ls_address.entire);
+    value = MEM_read(ls_address.entire);
     RB_write(rd, value);
     break;
   case 1:
-    tmp.entire = DATA_PORT->read(ls_address.entire);
+    tmp.entire = MEM_read(ls_address.entire);
     value = arm_isa::RotateRight(8,tmp).entire;
     RB_write(rd, value);
     break;
   case 2:
-    tmp.entire = DATA_PORT->read(ls_address.entire);
+    tmp.entire = MEM_read(ls_address.entire);
     value = arm_isa::RotateRight(16,tmp).entire;
     RB_write(rd, value);
     break;
   default:
-    tmp.entire = DATA_PORT->read(ls_address.entire);
+    tmp.entire = MEM_read(ls_address.entire);
     value = arm_isa::RotateRight(24, tmp).entire;
     RB_write(rd, value);
   }
 
   dprintf(" *  R%d <= 0x%08X\n", rd, value); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1465,15 +1416,12 @@ void arm_isa::MLA(int rd, int rn, int rm, int rs, bool s) {
 
   RD2.entire = RM2.entire * RS2.entire + RN2.entire;
   if(s == 1) {
-    flags.N = getBit(RD2.entire,31);
-    flags.Z = ((RD2.entire == 0) ? true : false);
-    // nothing happens with flags.C and flags.V
+    flags_set_nz(RD2.entire);
   }
   RB_write(rd,RD2.entire);
 
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1493,15 +1441,11 @@ void arm_isa::MOV(int rd, bool s) {
 #endif
   }
   if (s == 1) {
-    flags.N = getBit(dpi_shiftop.entire, 31);
-    flags.Z = ((dpi_shiftop.entire == 0) ? true : false);
-    flags.C = dpi_shiftopcarry;
-    // nothing happens with flags.V 
+    flags_set_logic(dpi_shiftop.entire, dpi_shiftopcarry);
   }
      
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, dpi_shiftop.entire, dpi_shiftop.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1540,8 +1484,6 @@ void arm_isa::MRS(int rd, bool r, int zero3, int subop2, int func2, int subop1,
   RB_write(rd,res);
 
   dprintf(" *  R%d <= 0x%08X\n", rd, res); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1562,15 +1504,12 @@ void arm_isa::MUL(int rd, int rm, int rs, bool s) {
 
   RD2.entire = RM2.entire * RS2.entire;
   if(s == 1) {
-    flags.N = getBit(RD2.entire, 31);
-    flags.Z = ((RD2.entire == 0) ? true : false);
-    // nothing happens with flags.C and flags.V
+    flags_set_nz(RD2.entire);
   }
   RB_write(rd, RD2.entire);
 
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1590,16 +1529,12 @@ void arm_isa::MVN(int rd, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(~dpi_shiftop.entire,31);
-      flags.Z = ((~dpi_shiftop.entire == 0) ? true : false);
-      flags.C = dpi_shiftopcarry;
-      // nothing happens with flags.V 
+      flags_set_logic(~dpi_shiftop.entire, dpi_shiftopcarry);
     }
   }   
 
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, ~dpi_shiftop.entire, ~dpi_shiftop.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1624,30 +1559,23 @@ void arm_isa::ORR(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = dpi_shiftopcarry;
-      // nothing happens with flags.V 
+      flags_set_logic(RD2.entire, dpi_shiftopcarry);
     }
   }  
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);  
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());  
 }
 
 //------------------------------------------------------
 void arm_isa::RSB(int rd, int rn, bool s) {
 
-  arm_isa::reg_t RD2, RN2, neg_RN2;
-  arm_isa::r64bit_t result;
+  arm_isa::reg_t RD2, RN2;
 
   dprintf("Instruction: RSB\n");
   RN2.entire = RB_read(rn);
   if(rn == PC) RN2.entire += 4;
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
-  neg_RN2.entire = - RN2.entire;
-  result.hilo = (uint64_t)(uint32_t)dpi_shiftop.entire + (uint64_t)(uint32_t)neg_RN2.entire;
-  RD2.entire = result.reg[0];
+  RD2.entire = (uint32_t)dpi_shiftop.entire - (uint32_t)RN2.entire;
   RB_write(rd, RD2.entire);
   if ((s == 1) && (rd == PC)) {
 #ifndef FORGIVE_UNPREDICTABLE
@@ -1660,32 +1588,25 @@ void arm_isa::RSB(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = !(((uint32_t) RN2.entire > (uint32_t) dpi_shiftop.entire) ? true : false);
-      flags.V = (((getBit(neg_RN2.entire,31) && getBit(dpi_shiftop.entire,31) && (!getBit(RD2.entire,31))) ||
-		  ((!getBit(neg_RN2.entire,31)) && (!getBit(dpi_shiftop.entire,31)) && getBit(RD2.entire,31))) ? true : false);
+      flags_set_add(dpi_shiftop.entire, ~RN2.entire, true, RD2.entire);
     }
   }
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
 void arm_isa::RSC(int rd, int rn, bool s) {
 
-  arm_isa::reg_t RD2, RN2, neg_RN2;
-  arm_isa::r64bit_t result;
+  arm_isa::reg_t RD2, RN2;
+  bool carry = flagC();
 
   dprintf("Instruction: RSC\n");
   RN2.entire = RB_read(rn);
   if(rn == PC) RN2.entire += 4;
-  dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n  Carry = %d\n", RN2.entire,dpi_shiftop.entire, flags.C);
-  if (!flags.C) { RN2.entire++; }  
-  neg_RN2.entire = - RN2.entire;
-  result.hilo = (uint64_t)(uint32_t)dpi_shiftop.entire + (uint64_t)(uint32_t)neg_RN2.entire;
-  RD2.entire = result.reg[0];
+  dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n  Carry = %d\n", RN2.entire,dpi_shiftop.entire, carry);
+  // shiftop - rn - !C == shiftop + ~rn + C
+  RD2.entire = (uint32_t)dpi_shiftop.entire + ~(uint32_t)RN2.entire + (carry ? 1 : 0);
 
   RB_write(rd, RD2.entire);
   if ((s == 1)&&(rd == PC)) {
@@ -1699,35 +1620,25 @@ void arm_isa::RSC(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      if ((!flags.C)&&(RN2.entire == 0))    
-          flags.C = false;                  
-      else
-          flags.C = !(((uint32_t) RN2.entire > (uint32_t) dpi_shiftop.entire) ? true : false);
-      flags.V = (((getBit(neg_RN2.entire,31) && getBit(dpi_shiftop.entire,31) && (!getBit(RD2.entire,31))) ||
-		  ((!getBit(neg_RN2.entire,31)) && (!getBit(dpi_shiftop.entire,31)) && getBit(RD2.entire,31))) ? true : false);
+      flags_set_add(dpi_shiftop.entire, ~RN2.entire, carry, RD2.entire);
     }
   }
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
 void arm_isa::SBC(int rd, int rn, bool s) {
 
-  arm_isa::reg_t RD2, RN2, neg_shiftop;
-  arm_isa::r64bit_t result;
+  arm_isa::reg_t RD2, RN2;
+  bool carry = flagC();
 
   dprintf("Instruction: SBC\n");
   RN2.entire = RB_read(rn);
   if(rn == PC) RN2.entire += 4;
-  dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n  Carry = %d\n", RN2.entire,dpi_shiftop.entire, flags.C);
-  if (!flags.C) dpi_shiftop.entire++;     
-  neg_shiftop.entire = - dpi_shiftop.entire;   
-  result.hilo = (uint64_t)(uint32_t)RN2.entire + (uint64_t)(uint32_t)neg_shiftop.entire;
-  RD2.entire = result.reg[0];
+  dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n  Carry = %d\n", RN2.entire,dpi_shiftop.entire, carry);
+  // rn - shiftop - !C == rn + ~shiftop + C
+  RD2.entire = (uint32_t)RN2.entire + ~(uint32_t)dpi_shiftop.entire + (carry ? 1 : 0);
   RB_write(rd, RD2.entire);
   if ((s == 1)&&(rd == PC)) {
 #ifndef FORGIVE_UNPREDICTABLE
@@ -1740,19 +1651,11 @@ void arm_isa::SBC(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      if ((!flags.C)&&(dpi_shiftop.entire==0))
-          flags.C = false;
-      else
-          flags.C = !(((uint32_t) dpi_shiftop.entire > (uint32_t) RN2.entire) ? true : false);
-      flags.V = (((getBit(RN2.entire,31) && getBit(neg_shiftop.entire,31) && (!getBit(RD2.entire,31))) ||
-		  ((!getBit(RN2.entire,31)) && (!getBit(neg_shiftop.entire,31)) && getBit(RD2.entire,31))) ? true : false);
+      flags_set_add(RN2.entire, ~dpi_shiftop.entire, carry, RD2.entire);
     }
   }
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire);
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1779,13 +1682,11 @@ void arm_isa::SMLAL(int rdhi, int rdlo, int rm, int rs, bool s) {
   RB_write(rdhi,result.reg[1]);
   RB_write(rdlo,result.reg[0]);
   if(s == 1){
-    flags.N = getBit(result.reg[1],31);
-    flags.Z = ((result.hilo == 0) ? true : false);
+    flags_set_nz64(result.hilo);
     // nothing happens with flags.C and flags.V
   }
   dprintf(" *  R%d(high) R%d(low) <= 0x%08X%08X (%d)\n", rdhi, rdlo, result.reg[1], result.reg[0], result.reg[0]); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1810,13 +1711,11 @@ void arm_isa::SMULL(int rdhi, int rdlo, int rm, int rs, bool s) {
   RB_write(rdhi,result.reg[1]);
   RB_write(rdlo,result.reg[0]);
   if(s == 1){
-    flags.N = getBit(result.reg[1],31);
-    flags.Z = ((result.hilo == 0) ? true : false);
+    flags_set_nz64(result.hilo);
     // nothing happens with flags.C and flags.V
   }
   dprintf(" *  R%d(high) R%d(low) <= 0x%08X%08X (%d)\n", rdhi, rdlo, result.reg[1], result.reg[0], result.reg[0]);
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -1831,21 +1730,22 @@ void arm_isa::STM(int rn, int rlist, unsigned r) {
     // todo special cases
 
     int i;
+    // Only the registers in the list are visited, lowest first (see LDM)
+    unsigned list;
 
     if (r == 0) { // STM(1) 
         dprintf("Instruction: STM\n");
         ls_address = lsm_startaddress;
-        for(i=0;i<16;i++){
-            if(isBitSet(rlist,i)) {
-                // rn is in rlist. e.g. push {sp,...}
-                if (i == rn)
-                    DATA_PORT->write(ls_address.entire,lsm_oldrn.entire);
-                else 
-                    DATA_PORT->write(ls_address.entire,RB_read(i));
-
-                ls_address.entire += 4;
-                dprintf(" *  Stored register: 0x%X; value: 0x%X; address: 0x%lX\n",i,RB_read(i),ls_address.entire-4);
-            }
+        for (list = rlist & 0xFFFF; list != 0; list &= list - 1) {
+            i = __builtin_ctz(list);
+            // rn is in rlist. e.g. push {sp,...}
+            if (i == rn)
+                MEM_write(ls_address.entire,lsm_oldrn.entire);
+            else 
+                MEM_write(ls_address.entire,RB_read(i));
+
+            ls_address.entire += 4;
+            dprintf(" *  Stored register: 0x%X; value: 0x%X; address: 0x%lX\n",i,RB_read(i),ls_address.entire-4);
         }
     } else { // STM(2)
 #ifndef FORGIVE_UNPREDICTABLE
@@ -1856,16 +1756,13 @@ void arm_isa::STM(int rn, int rlist, unsigned r) {
 #endif
         dprintf("Instruction: STM(2)\n");
         ls_address = lsm_startaddress;
-        for(i=0;i<16;i++){
-            if(isBitSet(rlist,i)) {
-                DATA_PORT->write(ls_address.entire,RB .read(i));
-                ls_address.entire += 4;
-                dprintf(" *  Stored register: 0x%X; value: 0x%X; address: 0x%lX\n",i,RB_read(i),ls_address.entire-4);
-            }
+        for (list = rlist & 0xFFFF; list != 0; list &= list - 1) {
+            i = __builtin_ctz(list);
+            MEM_write(ls_address.entire,(i == PC) ? (uint32_t)ac_pc : RB.read(i));
+            ls_address.entire += 4;
+            dprintf(" *  Stored register: 0x%X; value: 0x%X; address: 0x%lX\n",i,RB_read(i),ls_address.entire-4);
         }
     }
-
-    ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1876,11 +1773,9 @@ void arm_isa::STR(int rd, int rn) {
   // Special cases
   // verify coprocessor alignment
   
-  DATA_PORT->write(ls_address.entire, RB_read(rd));
+  MEM_write(ls_address.entire, RB_read(rd));
 
   dprintf(" *  MEM[0x%08X] <= 0x%08X\n", ls_address.entire, RB_read(rd)); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1893,11 +1788,9 @@ void arm_isa::STRB(int rd, int rn) {
   // Special cases
 
   RD2.entire = RB_read(rd);
-  DATA_PORT->write_byte(ls_address.entire, RD2.byte[0]);
+  MEM_write_byte(ls_address.entire, RD2.byte[0]);
 
   dprintf(" *  MEM[0x%08X] <= 0x%02X\n", ls_address.entire, RD2.byte[0]); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1910,11 +1803,9 @@ void arm_isa::STRBT(int rd, int rn) {
   // Special cases
   
   RD2.entire = RB_read(rd);
-  DATA_PORT->write_byte(ls_address.entire, RD2.byte[0]);
+  MEM_write_byte(ls_address.entire, RD2.byte[0]);
 
   dprintf(" *  MEM[0x%08X] <= 0x%02X\n", ls_address.entire, RD2.byte[0]); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1935,12 +1826,10 @@ void arm_isa::STRD(int rd, int rn) {
   }
 
   //FIXME: Check if writeback receives +4 from second address
-  DATA_PORT->write(ls_address.entire,RB_read(rd));
-  DATA_PORT->write(ls_address.entire+4,RB_read(rd+1));
+  MEM_write(ls_address.entire,RB_read(rd));
+  MEM_write(ls_address.entire+4,RB_read(rd+1));
 
   dprintf(" *  MEM[0x%08X], *DATA_PORT[0x%08X] <= 0x%08X %08X\n", ls_address.entire, ls_address.entire+4, RB_read(rd+1), RB_read(rd)); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1959,11 +1848,10 @@ void arm_isa::STRH(int rd, int rn) {
   }
 
   data = (int16_t) (RB_read(rd) & 0x0000FFFF);
-  DATA_PORT->write_half(ls_address.entire, data);
+  MEM_write_half(ls_address.entire, data);
 
   dprintf(" *  MEM[0x%08X] <= 0x%04X\n", ls_address.entire, data); 
     
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -1974,26 +1862,21 @@ void arm_isa::STRT(int rd, int rn) {
   // Special cases
   // verificar caso do coprocessador (alinhamento)
   
-  DATA_PORT->write(ls_address.entire, RB_read(rd));
+  MEM_write(ls_address.entire, RB_read(rd));
 
   dprintf(" *  MEM[0x%08X] <= 0x%08X\n", ls_address.entire, RB_read(rd)); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
 void arm_isa::SUB(int rd, int rn, bool s) {
 
-  arm_isa::reg_t RD2, RN2, neg_shiftop;
-  arm_isa::r64bit_t result;
+  arm_isa::reg_t RD2, RN2;
 
   dprintf("Instruction: SUB\n");
   RN2.entire = RB_read(rn);
   if(rn == PC) RN2.entire += 4;
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
-  neg_shiftop.entire = - dpi_shiftop.entire;
-  result.hilo = (uint64_t)(uint32_t)RN2.entire + (uint64_t)(uint32_t)neg_shiftop.entire;
-  RD2.entire = result.reg[0];
+  RD2.entire = (uint32_t)RN2.entire - (uint32_t)dpi_shiftop.entire;
   RB_write(rd, RD2.entire);
   if ((s == 1)&&(rd == PC)) {
 #ifndef FORGIVE_UNPREDICTABLE
@@ -2006,19 +1889,31 @@ void arm_isa::SUB(int rd, int rn, bool s) {
 #endif
   } else {
     if (s == 1) {
-      flags.N = getBit(RD2.entire,31);
-      flags.Z = ((RD2.entire == 0) ? true : false);
-      flags.C = !(((uint32_t) dpi_shiftop.entire > (uint32_t) RN2.entire) ? true : false);
-      flags.V = (((getBit(RN2.entire,31) && getBit(neg_shiftop.entire,31) && (!getBit(RD2.entire,31))) ||
-		  ((!getBit(RN2.entire,31)) && (!getBit(neg_shiftop.entire,31)) && getBit(RD2.entire,31))) ? true : false);
+      flags_set_add(RN2.entire, ~dpi_shiftop.entire, true, RD2.entire);
     }
   }
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, RD2.entire, RD2.entire); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
  
 }
 
+//------------------------------------------------------
+// The read and the write of a swap are issued back to back from here, the
+// only read-modify-write accesses of the model. A memory interface with
+// locked or atomic transfers would be used here to make SWP and SWPB
+// atomic with respect to other cores.
+uint32_t arm_isa::MemSwap(uint32_t address, uint32_t value) {
+  uint32_t old = MEM_read(address);
+  MEM_write(address, value);
+  return old;
+}
+
+uint8_t arm_isa::MemSwapByte(uint32_t address, uint8_t value) {
+  uint8_t old = MEM_read_byte(address);
+  MEM_write_byte(address, value);
+  return old;
+}
+
 //------------------------------------------------------
 void arm_isa::SWP(int rd, int rn, int rm) {
 
@@ -2039,30 +1934,17 @@ void arm_isa::SWP(int rd, int rn, int rm) {
   RM2.entire = RB_read(rm);
   rn10 = RN2.entire & 0x00000003;
 
-  switch(rn10) {
-  case 0:
-    tmp = DATA_PORT->read(RN2.entire);
-    break;
-  case 1:
-    rtmp.entire = DATA_PORT->read(RN2.entire);
-    tmp = (arm_isa::RotateRight(8,rtmp)).entire;
-    break;
-  case 2:
-    rtmp.entire = DATA_PORT->read(RN2.entire);
-    tmp = (arm_isa::RotateRight(16,rtmp)).entire;
-    break;
-  default:
-    rtmp.entire = DATA_PORT->read(RN2.entire);
-    tmp = (arm_isa::RotateRight(24,rtmp)).entire;
-  }
-    
-  DATA_PORT->write(RN2.entire,RM2.entire);
+  rtmp.entire = MemSwap(RN2.entire, RM2.entire);
+  // Unaligned addresses rotate the loaded word, as in LDR
+  if (rn10 == 0)
+    tmp = rtmp.entire;
+  else
+    tmp = (arm_isa::RotateRight(8 * rn10, rtmp)).entire;
+
   RB_write(rd,tmp);
 
   dprintf(" *  MEM[0x%08X] <= 0x%08X (%d)\n", RN2.entire, RM2.entire, RM2.entire); 
   dprintf(" *  R%d <= 0x%08X (%d)\n", rd, tmp, tmp); 
-
-  ac_pc = RB_read(PC);
 }
 
 //------------------------------------------------------
@@ -2082,14 +1964,78 @@ void arm_isa::SWPB(int rd, int rn, int rm) {
   RM2.entire = RB_read(rm);
   RN2.entire = RB_read(rn);
 
-  tmp = (uint32_t) DATA_PORT->read_byte(RN2.entire);
-  DATA_PORT->write_byte(RN2.entire,RM2.byte[0]);
+  tmp = (uint32_t) MemSwapByte(RN2.entire, RM2.byte[0]);
   RB_write(rd,tmp);
 
   dprintf(" *  MEM[0x%08X] <= 0x%02X (%d)\n", RN2.entire, RM2.byte[0], RM2.byte[0]); 
   dprintf(" *  R%d <= 0x%02X (%d)\n", rd, tmp, tmp); 
+}
+
+//------------------------------------------------------
+void arm_isa::LDREX(int rd, int rn) {
+
+  uint32_t address, value;
+
+  dprintf("Instruction: LDREX\n");
+
+  // Special cases
+  if((rd == PC)||(rn == PC)){
+    printf("Unpredictable LDREX instruction result\n");
+    return;
+  }
+
+  address = RB_read(rn);
+  value = MEM_read(address);
+
+  // A core holds a single reservation
+  if (excl_held)
+    excl_release(excl_address, core_index);
+  excl_reserve(address, core_index);
+  excl_held = true;
+  excl_address = address;
+
+  RB_write(rd, value);
+
+  dprintf(" *  R%d <= 0x%08X, MEM[0x%08X] reserved\n", rd, value, address);
+}
+
+//------------------------------------------------------
+void arm_isa::STREX(int rd, int rn, int rm) {
+
+  uint32_t address;
+  bool stored;
+
+  dprintf("Instruction: STREX\n");
+
+  // Special cases
+  if((rd == PC)||(rm == PC)||(rn == PC)||(rd == rn)||(rd == rm)){
+    printf("Unpredictable STREX instruction result\n");
+    return;
+  }
+
+  address = RB_read(rn);
+  stored = excl_held && ((excl_address & EXCL_GRANULE) == (address & EXCL_GRANULE)) &&
+    excl_release(address, core_index);
+  if (excl_held && !stored)
+    excl_release(excl_address, core_index);
+  excl_held = false;
+
+  if (stored)
+    MEM_write(address, RB_read(rm));
+  RB_write(rd, stored ? 0 : 1);
+
+  dprintf(" *  MEM[0x%08X] %s, R%d <= %d\n", address,
+          stored ? "written" : "not written", rd, stored ? 0 : 1);
+}
+
+//------------------------------------------------------
+void arm_isa::CLREX() {
 
-  ac_pc = RB_read(PC);
+  dprintf("Instruction: CLREX\n");
+
+  if (excl_held)
+    excl_release(excl_address, core_index);
+  excl_held = false;
 }
 
 //------------------------------------------------------
@@ -2102,13 +2048,9 @@ void arm_isa::TEQ(int rn) {
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
   alu_out.entire = RN2.entire ^ dpi_shiftop.entire;
 
-  flags.N = getBit(alu_out.entire,31);
-  flags.Z = ((alu_out.entire == 0) ? true : false);
-  flags.C = dpi_shiftopcarry;
-  // nothing happens with flags.V
+  flags_set_logic(alu_out.entire, dpi_shiftopcarry);
     
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);  
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());  
 }
 
 //------------------------------------------------------
@@ -2121,13 +2063,9 @@ void arm_isa::TST(int rn) {
   dprintf("Operands:\n  A = 0x%lX\n  B = 0x%lX\n", RN2.entire,dpi_shiftop.entire);
   alu_out.entire = RN2.entire & dpi_shiftop.entire;
 
-  flags.N = getBit(alu_out.entire, 31);
-  flags.Z = ((alu_out.entire == 0) ? true : false);
-  flags.C = dpi_shiftopcarry;
-  // nothing happens with flags.V
+  flags_set_logic(alu_out.entire, dpi_shiftopcarry);
     
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V); 
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV()); 
 }
 
 //------------------------------------------------------
@@ -2155,14 +2093,12 @@ void arm_isa::UMLAL(int rdhi, int rdlo, int rm, int rs, bool s) {
   RB_write(rdhi,result.reg[1]);
   RB_write(rdlo,result.reg[0]);
   if(s == 1){
-    flags.N = getBit(result.reg[1],31);
-    flags.Z = ((result.hilo == 0) ? true : false);
+    flags_set_nz64(result.hilo);
     // nothing happens with flags.C and flags.V
   }
 
   dprintf(" *  R%d(high) R%d(low) <= 0x%08X%08X (%d)\n", rdhi, rdlo, result.reg[1], result.reg[0], result.reg[0]); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -2188,13 +2124,11 @@ void arm_isa::UMULL(int rdhi, int rdlo, int rm, int rs, bool s) {
   RB_write(rdhi,result.reg[1]);
   RB_write(rdlo,result.reg[0]);
   if(s == 1){
-    flags.N = getBit(result.reg[1],31);
-    flags.Z = ((result.hilo == 0) ? true : false);
+    flags_set_nz64(result.hilo);
     // nothing happens with flags.C and flags.V
   }
   dprintf(" *  R%d(high) R%d(low) <= 0x%08X%08X (%d)\n", rdhi, rdlo, result.reg[1], result.reg[0], result.reg[0]); 
-  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flags.N,flags.Z,flags.C,flags.V);
-  ac_pc = RB_read(PC);
+  dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n",flagN(),flagZ(),flagC(),flagV());
 }
 
 //------------------------------------------------------
@@ -2409,7 +2343,6 @@ void ac_behavior( blx2 ){
 
   flags.T = isBitSet(rm, 0);
   RB_write(PC, dest.entire & 0xFFFFFFFE);
-  ac_pc = RB_read(PC);
 
   dprintf("Calculated branch destination: 0x%lX\n", RB_read(PC));  
 }
@@ -2420,6 +2353,15 @@ void ac_behavior( swp ){ SWP(rd, rn, rm); }
 //!Instruction swpb behavior method.
 void ac_behavior( swpb ){ SWPB(rd, rn, rm); }
 
+//!Instruction ldrex behavior method.
+void ac_behavior( ldrex ){ LDREX(rd, rn); }
+
+//!Instruction strex behavior method.
+void ac_behavior( strex ){ STREX(rd, rn, rm); }
+
+//!Instruction clrex behavior method.
+void ac_behavior( clrex ){ CLREX(); }
+
 //!Instruction mla behavior method.
 void ac_behavior( mla ){ MLA(rn, rd, rm, rs, s);}
 // OBS: inversao dos parametros proposital ("fields with the same name...")
@@ -2585,8 +2527,8 @@ void ac_behavior( msr1 ){
     writeCPSR(res);
     dprintf(" *  CPSR <= 0x%08X\n", res); 
     dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n     FIQ disable"
-            "=0x%X, IRQ disable=0x%X, Thumb=0x%X\n",flags.N,flags.Z,
-            flags.C,flags.V, arm_proc_mode.fiq, arm_proc_mode.irq,
+            "=0x%X, IRQ disable=0x%X, Thumb=0x%X\n",flagN(),flagZ(),
+            flagC(),flagV(), arm_proc_mode.fiq, arm_proc_mode.irq,
             arm_proc_mode.thumb);
     dprintf(" *  Processor mode <= %s MODE\n", cur_mode_str());
   } else { // r == 1, write to SPSR
@@ -2643,8 +2585,8 @@ void ac_behavior( msr2 ){
     writeCPSR(res);
     dprintf(" *  CPSR <= 0x%08X\n", res); 
     dprintf(" *  Flags <= N=0x%X, Z=0x%X, C=0x%X, V=0x%X\n     FIQ disable"
-            "=0x%X, IRQ disable=0x%X, Thumb=0x%X\n",flags.N,flags.Z,
-            flags.C,flags.V, arm_proc_mode.fiq, arm_proc_mode.irq,
+            "=0x%X, IRQ disable=0x%X, Thumb=0x%X\n",flagN(),flagZ(),
+            flagC(),flagV(), arm_proc_mode.fiq, arm_proc_mode.irq,
             arm_proc_mode.thumb);
     dprintf(" *  Processor mode <= %s MODE\n", cur_mode_str());
   } else { // r == 1, write to SPSR
@@ -2697,4 +2639,11 @@ void ac_behavior( dsmulw ){
   fprintf(stderr,"Warning: SMULW<y><x> instruction is not implemented in this model. PC=%X\n", ac_pc.read());
 }
 
-void ac_behavior( end ) { }
+void ac_behavior( end ) {
+#ifdef BINARY_TRACE
+  if (trace_out) {
+    delete trace_out; // flushes the last chunk
+    trace_out = NULL;
+  }
+#endif
+}
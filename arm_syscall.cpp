@@ -24,34 +24,53 @@
 using namespace arm_parms;
 
 void arm_syscall::get_buffer(int argn, unsigned char* buf, unsigned int size) {
-  unsigned int addr = RB.read(argn);
-
-  for (unsigned int i = 0; i<size; i++, addr++) {
-    buf[i] = DATA_PORT->read_byte(addr);
-  }
+  guest2hostmemcpy(buf, RB.read(argn), size);
 }
 
+// The buffer copies move whole words through DATA_PORT where the guest
+// address is word aligned, so a buffer costs one port access per word
+// instead of one per byte. Words are split and assembled by value, with
+// the byte at the lowest address in bits 7-0 (little endian model), so the
+// copies do not depend on the host byte order.
+//
+// These two copies are the only way ac_syscall reaches guest memory: read,
+// write, readv and writev bounce every buffer through them. The model sees
+// memory only through DATA_PORT, which may be a TLM port or a cache, so it
+// cannot hand host iovecs pointing into the RAM backing to the host kernel;
+// that has to be done by ac_syscall against ac_storage, falling back to
+// these copies for any other port.
 void arm_syscall::guest2hostmemcpy(unsigned char *dst, uint32_t src,
                                    unsigned int size) {
-  for (unsigned int i = 0; i < size; i++) {
+  unsigned int i = 0;
+
+  for (; i < size && (src & 3); i++)
     dst[i] = DATA_PORT->read_byte(src++);
+  for (; i + 4 <= size; i += 4, src += 4) {
+    uint32_t word = DATA_PORT->read(src);
+    dst[i]     = word;
+    dst[i + 1] = word >> 8;
+    dst[i + 2] = word >> 16;
+    dst[i + 3] = word >> 24;
   }
+  for (; i < size; i++)
+    dst[i] = DATA_PORT->read_byte(src++);
 }
 
 void arm_syscall::set_buffer(int argn, unsigned char* buf, unsigned int size) {
-  unsigned int addr = RB.read(argn);
-
-  for (unsigned int i = 0; i<size; i++, addr++) {
-     DATA_PORT->write_byte(addr, buf[i]);
-     //printf("\nMEM[%d]=%d", addr, buf[i]);
-  }
+  host2guestmemcpy(RB.read(argn), buf, size);
 }
 
 void arm_syscall::host2guestmemcpy(uint32_t dst, unsigned char *src,
                                    unsigned int size) {
-  for (unsigned int i = 0; i < size; i++) {
+  unsigned int i = 0;
+
+  for (; i < size && (dst & 3); i++)
+    DATA_PORT->write_byte(dst++, src[i]);
+  for (; i + 4 <= size; i += 4, dst += 4)
+    DATA_PORT->write(dst, src[i] | (src[i + 1] << 8) | (src[i + 2] << 16) |
+                     ((uint32_t)src[i + 3] << 24));
+  for (; i < size; i++)
     DATA_PORT->write_byte(dst++, src[i]);
-  }
 }
 
 void arm_syscall::set_buffer_noinvert(int argn, unsigned char* buf, unsigned int size) {
@@ -63,7 +82,6 @@ void arm_syscall::set_buffer_noinvert(int argn, unsigned char* buf, unsigned int
 }
 
 void arm_syscall::set_pc(unsigned val) {
-  RB.write(15, val);
   ac_pc.write(val);
 }
  
@@ -87,6 +105,10 @@ void arm_syscall::return_from_syscall() {
   ac_pc = RB.read(14);
 }
 
+// MAP_ANONYMOUS in the ARM Linux ABI. ac_syscall serves mmap and mmap2
+// only for anonymous mappings, carved out of the flat MEM array; file
+// mappings would need host pages behind guest addresses, which a single
+// ac_storage block cannot provide.
 bool arm_syscall::is_mmap_anonymous(uint32_t flags) {
   return flags & 0x20;
 }
@@ -0,0 +1,56 @@
+/**
+ * @file      armtrace.cpp
+ *
+ *            The ArchC Team
+ *            http://www.archc.org/
+ *
+ *            Computer Systems Laboratory (LSC)
+ *            IC-UNICAMP
+ *            http://www.lsc.ic.unicamp.br/
+ *
+ * @brief     Prints a binary trace written by the ARM model (see
+ *            arm_trace.H) as text, one instruction per line.
+ *
+ *            g++ -O2 -o armtrace armtrace.cpp
+ *            armtrace <trace-file> [first-instruction [count]]
+ *
+ * @attention Copyright (C) 2002-2012 --- The ArchC Team
+ *
+ */
+
+#include "arm_trace.H"
+#include <stdlib.h>
+#include <inttypes.h>
+
+int main(int argc, char **argv) {
+  static arm_trace_reader reader;
+  static arm_trace_record rec;
+  uint64_t first = 0, count = 0;
+
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "usage: %s <trace-file> [first-instruction [count]]\n", argv[0]);
+    return 1;
+  }
+  if (!reader.open(argv[1])) {
+    fprintf(stderr, "%s: not an ARM trace file\n", argv[1]);
+    return 1;
+  }
+  if (argc > 2) first = strtoull(argv[2], NULL, 0);
+  if (argc > 3) count = strtoull(argv[3], NULL, 0);
+  if (first && !reader.seek(first)) return 0;
+
+  for (uint64_t n = 0; (count == 0 || n < count) && reader.next(rec); n++) {
+    printf("%" PRIu64 " %08x: %08x%s", rec.index, rec.pc, rec.word,
+           rec.executed ? "" : " (not executed)");
+    for (unsigned i = 0; i < rec.nevents; i++) {
+      const arm_trace_event &e = rec.events[i];
+      if (e.kind == 0)
+        printf(" r%u=%08x", e.reg, e.value);
+      else
+        printf(" %s%u[%08x]=%0*x", (e.kind == ARM_TRACE_LOAD) ? "ld" : "st",
+               e.size, e.addr, e.size * 2, e.value);
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file      bitbench.cpp
+ *
+ *            The ArchC Team
+ *            http://www.archc.org/
+ *
+ *            Computer Systems Laboratory (LSC)
+ *            IC-UNICAMP
+ *            http://www.lsc.ic.unicamp.br/
+ *
+ * @brief     Compares the bit helpers of arm_isa_helper.H (CLZ, register
+ *            list count and RotateRight) with the code they replaced:
+ *            checks that both give the same results and prints the time
+ *            each one takes on the same random inputs.
+ *
+ *            g++ -O2 -o bitbench bitbench.cpp
+ *            bitbench [iterations]
+ *
+ * @attention Copyright (C) 2002-2012 --- The ArchC Team
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+// The helpers are copied here because arm_isa_helper.H is part of the
+// arm_isa class body and cannot be included on its own.
+
+static inline bool old_isBitSet(uint32_t variable, int position) {
+  return ((variable & (1 << position)) != 0) ? true : false;
+}
+
+static inline uint32_t old_clz(uint32_t value) {
+  int i;
+  if (value == 0) return 32;
+  i = 31;
+  while ((i >= 0) && (!old_isBitSet(value, i))) i--;
+  return 31 - i;
+}
+
+static inline uint32_t new_clz(uint32_t value) {
+  if (value == 0) return 32;
+  return __builtin_clz(value);
+}
+
+static inline int old_count(uint32_t list) {
+  int i, count;
+  count = 0;
+  for (i = 0; i < 16; i++)
+    if (old_isBitSet(list, i)) count++;
+  return count;
+}
+
+static inline int new_count(uint32_t list) {
+  return __builtin_popcount(list & 0xFFFF);
+}
+
+// Only called with 1-31: a count of 0 shifts by 32 (undefined)
+static inline uint32_t old_ror(int shiftamount, uint32_t value) {
+  return (value >> shiftamount) | (value << (32 - shiftamount));
+}
+
+static inline uint32_t new_ror(int shiftamount, uint32_t value) {
+  return (value >> (shiftamount & 31)) | (value << ((32 - shiftamount) & 31));
+}
+
+static const unsigned NINPUTS = 4096; // power of two
+static uint32_t input[NINPUTS];
+
+static double seconds(void) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// Runs expr over the inputs iterations times and prints its time. x is the
+// current input; the results are summed so that nothing is optimized away.
+#define BENCH(name, expr) do {                                    \
+    uint32_t sum = 0;                                             \
+    double start = seconds();                                     \
+    for (unsigned long n = 0; n < iterations; n++) {              \
+      uint32_t x = input[n & (NINPUTS - 1)];                      \
+      sum += (uint32_t)(expr);                                    \
+    }                                                             \
+    printf("%-16s %6.3fs  (%08x)\n", name, seconds() - start, sum); \
+  } while (0)
+
+int main(int argc, char **argv) {
+  unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000000UL;
+  unsigned errors = 0;
+
+  srand(1);
+  for (unsigned i = 0; i < NINPUTS; i++) {
+    // Mix in small values, so that CLZ sees long runs of zeros
+    input[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    if (i & 1) input[i] >>= input[i] & 31;
+  }
+
+  for (unsigned i = 0; i < NINPUTS; i++) {
+    uint32_t x = input[i];
+    int amount = 1 + (x % 31);
+    errors += old_clz(x) != new_clz(x);
+    errors += old_count(x) != new_count(x);
+    errors += old_ror(amount, x) != new_ror(amount, x);
+  }
+  if (errors) {
+    printf("%u mismatches between the old and new helpers\n", errors);
+    return 1;
+  }
+
+  BENCH("clz old", old_clz(x));
+  BENCH("clz new", new_clz(x));
+  BENCH("count old", old_count(x));
+  BENCH("count new", new_count(x));
+  BENCH("ror old", old_ror(1 + (x & 15) * 2, x));
+  BENCH("ror new", new_ror(1 + (x & 15) * 2, x));
+  return 0;
+}